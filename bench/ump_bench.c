@@ -0,0 +1,92 @@
+/*
+ *  rb3-wireless-keytar-midi
+ *
+ *  Copyright (c) 2015 Delio Brignoli. All rights reserved. See LICENSE file.
+ *
+ */
+
+/*
+ * Measure conversion throughput of the internal 32-bit event format to MIDI 1.0 bytes
+ * and to MIDI 2.0 UMP. Does not need CoreMIDI, see README for build instructions.
+ *
+ * usage: ump_bench [batch_count]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/midi_ump.h"
+
+#define BATCH_EVENTS (64) /* same as MIDI_EVENT_MAX */
+#define DEFAULT_BATCH_COUNT (2000000)
+/* only note on slots (i % 8 == 0 in fill_batch_) so the toggled bit is always the velocity
+ * LSB, real time slots must keep their data bytes zero */
+#define VARY_SLOT_(b) (((b) % (BATCH_EVENTS/8))*8)
+
+static double now_sec_(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* mix of the messages the keytar generates */
+static void fill_batch_(uint32_t *events, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint8_t v = i & 0x7F;
+        switch (i % 8) {
+            case 0: events[i] = ump_note_on(0, 48+(i%25), v); break;
+            case 1: events[i] = ump_note_off(0, 48+(i%25), 0); break;
+            case 2: events[i] = ump_control_change(0, 1, v); break;
+            case 3: events[i] = ump_pitch_bend(0, v, 0x7F-v); break;
+            case 4: events[i] = ump_control_change(0, 0x0B, v); break;
+            case 5: events[i] = ump_control_change(0, 0x40, v ? 0x7F : 0); break;
+            case 6: events[i] = ump_program_change(0, v); break;
+            default: events[i] = ump_realtime(0xFA); break;
+        }
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    size_t batch_count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_BATCH_COUNT;
+    if (!batch_count)
+        batch_count = DEFAULT_BATCH_COUNT;
+
+    uint32_t events[BATCH_EVENTS];
+    uint8_t bytes[BATCH_EVENTS*UMP_MIDI1_MAX_BYTES];
+    uint32_t words[BATCH_EVENTS*UMP_MIDI2_WORDS];
+    fill_batch_(events, BATCH_EVENTS);
+
+    /* fold outputs into a checksum so the conversions can't be optimized away */
+    volatile uint32_t sink = 0;
+    uint32_t sum = 0;
+    double total_events = (double)batch_count*BATCH_EVENTS;
+
+    double start = now_sec_();
+    for (size_t b = 0; b < batch_count; b++) {
+        /* vary one data byte per batch so the input is not loop invariant */
+        events[VARY_SLOT_(b)] ^= 1;
+        size_t n = ump_to_midi1_bytes(events, BATCH_EVENTS, bytes);
+        sum += n + bytes[b % n];
+    }
+    double midi1_sec = now_sec_() - start;
+    sink = sum;
+
+    start = now_sec_();
+    for (size_t b = 0; b < batch_count; b++) {
+        events[VARY_SLOT_(b)] ^= 1;
+        size_t n = ump_to_midi2(events, BATCH_EVENTS, words);
+        sum += n + words[b % n];
+    }
+    double midi2_sec = now_sec_() - start;
+    sink = sum;
+    (void)sink;
+
+    printf("%zu batches of %d events\n", batch_count, BATCH_EVENTS);
+    printf("MIDI 1.0 bytes: %8.1f M events/s\n", total_events/midi1_sec/1e6);
+    printf("MIDI 2.0 UMP:   %8.1f M events/s\n", total_events/midi2_sec/1e6);
+    return 0;
+}
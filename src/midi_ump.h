@@ -0,0 +1,216 @@
+/*
+ *  rb3-wireless-keytar-midi
+ *
+ *  Copyright (c) 2015 Delio Brignoli. All rights reserved. See LICENSE file.
+ *
+ */
+
+#ifndef MIDI_UMP_H
+#define MIDI_UMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Internal MIDI event representation.
+ *
+ * Every event is a single 32-bit Universal MIDI Packet word (UMP, MIDI 2.0 spec):
+ *     message type 0x1 : system real time, 0x1G SS 00 00
+ *     message type 0x2 : MIDI 1.0 channel voice, 0x2G SC D1 D2
+ * where G is the group, SS the status byte and D1, D2 the data bytes.
+ *
+ * Because events have a fixed size a batch of events is a plain uint32_t array that can be
+ * copied, filtered and transformed with simple loops. Conversion to a MIDI 1.0 byte stream
+ * or to MIDI 2.0 channel voice messages only happens when the batch is sent.
+ */
+
+#define UMP_MT_SYSTEM (0x1)
+#define UMP_MT_MIDI1_CHANNEL_VOICE (0x2)
+#define UMP_MT_MIDI2_CHANNEL_VOICE (0x4)
+
+#define UMP_GROUP (0)
+
+/* Largest MIDI 1.0 message generated from a single event */
+#define UMP_MIDI1_MAX_BYTES (3)
+/* Largest MIDI 2.0 UMP (a channel voice message) generated from a single event, in words */
+#define UMP_MIDI2_WORDS (2)
+
+static inline uint32_t ump_midi1_(uint8_t status, uint8_t data1, uint8_t data2)
+{
+    return ((uint32_t)UMP_MT_MIDI1_CHANNEL_VOICE<<28)|((uint32_t)UMP_GROUP<<24)|
+    ((uint32_t)status<<16)|((uint32_t)(data1 & 0x7F)<<8)|(uint32_t)(data2 & 0x7F);
+}
+
+static inline uint32_t ump_note_on(uint8_t channel, uint8_t note, uint8_t velocity)
+{
+    return ump_midi1_(0x90|(channel & 0xF), note, velocity);
+}
+
+static inline uint32_t ump_note_off(uint8_t channel, uint8_t note, uint8_t velocity)
+{
+    return ump_midi1_(0x80|(channel & 0xF), note, velocity);
+}
+
+static inline uint32_t ump_control_change(uint8_t channel, uint8_t ctrl, uint8_t value)
+{
+    return ump_midi1_(0xB0|(channel & 0xF), ctrl, value);
+}
+
+static inline uint32_t ump_program_change(uint8_t channel, uint8_t program)
+{
+    return ump_midi1_(0xC0|(channel & 0xF), program, 0);
+}
+
+/* lsb and msb are the two 7-bit halves of the 14-bit bend value, 0x40 msb is center */
+static inline uint32_t ump_pitch_bend(uint8_t channel, uint8_t lsb, uint8_t msb)
+{
+    return ump_midi1_(0xE0|(channel & 0xF), lsb, msb);
+}
+
+static inline uint32_t ump_realtime(uint8_t status)
+{
+    return ((uint32_t)UMP_MT_SYSTEM<<28)|((uint32_t)UMP_GROUP<<24)|((uint32_t)status<<16);
+}
+
+static inline uint8_t ump_type(uint32_t ump)
+{
+    return ump>>28;
+}
+
+static inline uint8_t ump_status(uint32_t ump)
+{
+    return (ump>>16) & 0xFF;
+}
+
+static inline uint8_t ump_data1(uint32_t ump)
+{
+    return (ump>>8) & 0x7F;
+}
+
+static inline uint8_t ump_data2(uint32_t ump)
+{
+    return ump & 0x7F;
+}
+
+/*
+ * Convert a batch of events to a MIDI 1.0 byte stream.
+ *
+ * Running status is not used so the output can be split at any message boundary. Every
+ * event is written as UMP_MIDI1_MAX_BYTES bytes and the output pointer is then advanced
+ * by the actual message length, so the only per-message-type work is picking that length.
+ * The output offset depends on every previous event so this loop does not vectorize.
+ * `out` must have room for count*UMP_MIDI1_MAX_BYTES bytes. Returns the number of bytes
+ * written.
+ */
+static inline size_t ump_to_midi1_bytes(const uint32_t *events, size_t count, uint8_t *out)
+{
+    uint8_t *p = out;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t ump = events[i];
+        uint8_t status = ump_status(ump);
+        p[0] = status;
+        p[1] = ump_data1(ump);
+        p[2] = ump_data2(ump);
+        /* system messages we generate are single byte, program change and
+         * channel pressure carry one data byte, everything else two */
+        size_t len = 3;
+        if (ump_type(ump) == UMP_MT_SYSTEM)
+            len = 1;
+        else if ((status & 0xE0) == 0xC0)
+            len = 2;
+        p += len;
+    }
+    return p - out;
+}
+
+/*
+ * Min-center-max upscaling as described in the MIDI 2.0 protocol specification: zero maps
+ * to zero, the source center value maps to the destination center value and the maximum
+ * source value maps to the maximum destination value.
+ */
+static inline uint32_t ump_scale_up(uint32_t val, uint8_t src_bits, uint8_t dst_bits)
+{
+    uint8_t scale_bits = dst_bits - src_bits;
+    uint32_t shifted = val << scale_bits;
+    uint32_t src_center = 1u << (src_bits - 1);
+    if (val <= src_center)
+        return shifted;
+
+    uint8_t repeat_bits = src_bits - 1;
+    uint32_t repeat_val = val & ((1u << repeat_bits) - 1);
+    if (scale_bits > repeat_bits)
+        repeat_val <<= scale_bits - repeat_bits;
+    else
+        repeat_val >>= repeat_bits - scale_bits;
+    while (repeat_val) {
+        shifted |= repeat_val;
+        repeat_val >>= repeat_bits;
+    }
+    return shifted;
+}
+
+/*
+ * Convert a batch of events to MIDI 2.0 UMP.
+ *
+ * Channel voice messages are translated to 64-bit MIDI 2.0 channel voice messages with
+ * 16-bit velocity and 32-bit controller and pitch bend values. System messages are the
+ * same in both protocols and are copied as a single word, so the output only contains
+ * real messages and can be handed to CoreMIDI as is. `out` must have room for
+ * count*UMP_MIDI2_WORDS words. Returns the number of words written.
+ */
+static inline size_t ump_to_midi2(const uint32_t *events, size_t count, uint32_t *out)
+{
+    uint32_t *w = out;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t ump = events[i];
+
+        if (ump_type(ump) != UMP_MT_MIDI1_CHANNEL_VOICE) {
+            *w++ = ump;
+            continue;
+        }
+
+        uint8_t status = ump_status(ump);
+        uint8_t data1 = ump_data1(ump);
+        uint8_t data2 = ump_data2(ump);
+        /* MIDI 1.0 note on with zero velocity is a note off */
+        if ((status & 0xF0) == 0x90 && !data2)
+            status = 0x80 | (status & 0xF);
+
+        uint32_t head = ((uint32_t)UMP_MT_MIDI2_CHANNEL_VOICE<<28)|((uint32_t)UMP_GROUP<<24)|
+        ((uint32_t)status<<16);
+        switch (status & 0xF0) {
+            case 0x80:
+            case 0x90:
+                /* note number in index byte, no attribute */
+                w[0] = head|((uint32_t)data1<<8);
+                w[1] = ump_scale_up(data2, 7, 16)<<16;
+                break;
+            case 0xB0:
+                w[0] = head|((uint32_t)data1<<8);
+                w[1] = ump_scale_up(data2, 7, 32);
+                break;
+            case 0xC0:
+                /* no bank select, option flags left clear */
+                w[0] = head;
+                w[1] = (uint32_t)data1<<24;
+                break;
+            case 0xE0:
+                w[0] = head;
+                w[1] = ump_scale_up(((uint32_t)data2<<7)|data1, 14, 32);
+                break;
+            case 0xA0:
+                w[0] = head|((uint32_t)data1<<8);
+                w[1] = ump_scale_up(data2, 7, 32);
+                break;
+            default:
+                /* channel pressure */
+                w[0] = head;
+                w[1] = ump_scale_up(data1, 7, 32);
+                break;
+        }
+        w += UMP_MIDI2_WORDS;
+    }
+    return w - out;
+}
+
+#endif /* MIDI_UMP_H */
@@ -9,8 +9,11 @@
 #import <CoreMIDI/MIDIServices.h>
 
 #include "rb3_wireless_midi.h"
+#include "midi_ump.h"
 
 #define USE_MATCHING_DICT 1
+/* Publish a MIDI 2.0 source (requires macOS 11.0 at runtime, falls back to MIDI 1.0 otherwise) */
+#define USE_MIDI2_UMP_OUTPUT 0
 
 #define VENDOR_ID (0x1BAD)
 #define PRODUCT_ID (0x3330)
@@ -19,7 +22,13 @@
 #define MIN_OCTAVE (0)
 #define MAX_OCTAVE (8)
 #define DEFAULT_OCTAVE (4)
-#define MIDI_BUFSZ (128)
+#define MIDI_BUFSZ (256) /* MIDI_EVENT_MAX*UMP_MIDI1_MAX_BYTES data bytes plus packet list headers */
+#define MIDI_EVENT_MAX (64) /* 25 keys plus buttons, touchstrip and pedal fit comfortably */
+#if USE_MIDI2_UMP_OUTPUT
+/* a full event batch as MIDI 2.0 words in one packet, sizeof(MIDIEventList) covers the headers.
+ * MIDIEventList is macOS 11+ only, expand this inside __builtin_available() checks only. */
+#define MIDI_EVENTLIST_SZ (sizeof(MIDIEventList) + MIDI_EVENT_MAX*UMP_MIDI2_WORDS*sizeof(uint32_t))
+#endif
 #define FIRST_GENERAL_MIDI_DRUM_NOTE (35)
 #define MIN_PROGRAM (0)
 #define MAX_PROGRAM (127)
@@ -80,9 +89,17 @@ struct rb_keytar_dev {
     MIDIClientRef midiclient;
     MIDIPortRef midiport;
     MIDIEndpointRef  midiout;
-    MIDIPacket *midi_curpacket;
     size_t midi_packetlist_sz;
     MIDIPacketList *midi_packetlist;
+#if USE_MIDI2_UMP_OUTPUT
+    size_t midi_eventlist_sz;
+    void *midi_eventlist; /* MIDIEventList, opaque here because the type is macOS 11+ only */
+#endif
+    bool midi2_output;
+
+    /* events generated while handling the current report, sent as a single packet */
+    size_t midi_event_count;
+    uint32_t midi_events[MIDI_EVENT_MAX];
 
     uint8_t channel;
     uint8_t octave;
@@ -131,38 +148,48 @@ err:
     return NULL;
 }
 
-static void midipacketlist_send_(struct rb_keytar_dev *ktr_dev)
+static void midi_events_send_(struct rb_keytar_dev *ktr_dev, MIDITimeStamp time)
 {
-    if (ktr_dev->midi_curpacket && ktr_dev->midi_packetlist->numPackets) {
-        MIDIReceived(ktr_dev->midiout, ktr_dev->midi_packetlist);
-        ktr_dev->midi_curpacket = NULL;
+    if (!ktr_dev->midi_event_count)
+        return;
+
+#if USE_MIDI2_UMP_OUTPUT
+    if (__builtin_available(macOS 11.0, *)) {
+        if (ktr_dev->midi2_output) {
+            uint32_t words[MIDI_EVENT_MAX*UMP_MIDI2_WORDS];
+            size_t word_count = ump_to_midi2(ktr_dev->midi_events, ktr_dev->midi_event_count, words);
+            MIDIEventList *evtlist = ktr_dev->midi_eventlist;
+            MIDIEventPacket *pkt = MIDIEventListInit(evtlist, kMIDIProtocol_2_0);
+            pkt = MIDIEventListAdd(evtlist, ktr_dev->midi_eventlist_sz, pkt, time,
+                                   word_count, words);
+            assert(pkt);
+            MIDIReceivedEventList(ktr_dev->midiout, evtlist);
+            ktr_dev->midi_event_count = 0;
+            return;
+        }
     }
+#endif
+
+    uint8_t bytes[MIDI_EVENT_MAX*UMP_MIDI1_MAX_BYTES];
+    size_t byte_count = ump_to_midi1_bytes(ktr_dev->midi_events, ktr_dev->midi_event_count, bytes);
+    MIDIPacket *pkt = MIDIPacketListInit(ktr_dev->midi_packetlist);
+    pkt = MIDIPacketListAdd(ktr_dev->midi_packetlist, ktr_dev->midi_packetlist_sz,
+                            pkt, time, byte_count, bytes);
+    assert(pkt);
+    MIDIReceived(ktr_dev->midiout, ktr_dev->midi_packetlist);
+    ktr_dev->midi_event_count = 0;
 }
 
-static void midipacket_add_(struct rb_keytar_dev *ktr_dev, MIDITimeStamp time,
-                            ByteCount nData, const Byte *data)
+static inline void midi_event_add_(struct rb_keytar_dev *ktr_dev, uint32_t ump)
 {
-    if (!ktr_dev->midi_curpacket)
-        ktr_dev->midi_curpacket = MIDIPacketListInit(ktr_dev->midi_packetlist);
-
-    MIDIPacket *tmp = MIDIPacketListAdd(ktr_dev->midi_packetlist, ktr_dev->midi_packetlist_sz,
-                                        ktr_dev->midi_curpacket, time, nData, data);
-    if (!tmp) {
-        MIDIReceived(ktr_dev->midiout, ktr_dev->midi_packetlist);
-        ktr_dev->midi_curpacket = MIDIPacketListInit(ktr_dev->midi_packetlist);
-        tmp = MIDIPacketListAdd(ktr_dev->midi_packetlist, ktr_dev->midi_packetlist_sz,
-                                ktr_dev->midi_curpacket, time, nData, data);
-    }
-
-    assert(tmp);
-    ktr_dev->midi_curpacket = tmp;
+    if (ktr_dev->midi_event_count == MIDI_EVENT_MAX)
+        midi_events_send_(ktr_dev, 0);
+    ktr_dev->midi_events[ktr_dev->midi_event_count++] = ump;
 }
 
 static void midi_panic_(struct rb_keytar_dev *ktr_dev)
 {
-    MIDITimeStamp timestamp = 0;
-    uint8_t alloff[3]= {0xB0 | ktr_dev->channel, 0x78, 0x00};
-    midipacket_add_(ktr_dev, timestamp, sizeof(alloff), alloff);
+    midi_event_add_(ktr_dev, ump_control_change(ktr_dev->channel, 0x78, 0x00));
 }
 
 static inline uint32_t key_bits_(uint8_t *report_buffer)
@@ -277,22 +304,22 @@ static void handle_input_report(void * inContext,
             goto next_key;
         /* process key */
         uint8_t midi_note_idx = (ktr_dev->octave*12)+key_idx;
-        uint8_t midi_note[3] = {ktr_dev->channel & 0xF, midi_note_idx, 0x00};
+        uint8_t channel = ktr_dev->channel;
+        uint8_t note = midi_note_idx;
         if (ktr_dev->drum_mapping && midi_note_idx < 12) {
             /* drums only on channel 10 */
-            midi_note[0] = 0x9;
-            midi_note[1] = FIRST_GENERAL_MIDI_DRUM_NOTE+key_idx;
+            channel = 0x9;
+            note = FIRST_GENERAL_MIDI_DRUM_NOTE+key_idx;
         }
         if (key_new_bits & 0x80000000) {
             /* key on */
-            midi_note[0] |= 0x90;
-            midi_note[2] = new_note_cnt < VELOCITY_SLOT_COUNT ? new_key_vel[new_note_cnt] : 0x40;
+            uint8_t vel = new_note_cnt < VELOCITY_SLOT_COUNT ? new_key_vel[new_note_cnt] : 0x40;
+            midi_event_add_(ktr_dev, ump_note_on(channel, note, vel));
             new_note_cnt++;
         } else {
             /* key off */
-            midi_note[0] |= 0x80;
+            midi_event_add_(ktr_dev, ump_note_off(channel, note, 0x00));
         }
-        midipacket_add_(ktr_dev, timestamp, sizeof(midi_note), midi_note);
 
     next_key:
         key_changed_bits <<= 1;
@@ -307,16 +334,13 @@ static void handle_input_report(void * inContext,
             midi_panic_(ktr_dev);
         } else if (single_key_edge_(ktr_dev, BTN_MHP_IDX, BTN_MINUS_MASK)) {
             /* send MIDI stop */
-            uint8_t realtimemsg[]= {0xFA+2};
-            midipacket_add_(ktr_dev, timestamp, sizeof(realtimemsg), realtimemsg);
+            midi_event_add_(ktr_dev, ump_realtime(0xFA+2));
         } else if (single_key_edge_(ktr_dev, BTN_MHP_IDX, BTN_HOME_MASK)) {
             /* send MIDI continue */
-            uint8_t realtimemsg[]= {0xFA+1};
-            midipacket_add_(ktr_dev, timestamp, sizeof(realtimemsg), realtimemsg);
+            midi_event_add_(ktr_dev, ump_realtime(0xFA+1));
         } else if (single_key_edge_(ktr_dev, BTN_MHP_IDX, BTN_PLUS_MASK)) {
             /* send MIDI start */
-            uint8_t realtimemsg[]= {0xFA+0};
-            midipacket_add_(ktr_dev, timestamp, sizeof(realtimemsg), realtimemsg);
+            midi_event_add_(ktr_dev, ump_realtime(0xFA+0));
         }
     }
 
@@ -347,8 +371,7 @@ static void handle_input_report(void * inContext,
             break;
         }
 
-        uint8_t pchange[2]= {0xC0 | ktr_dev->channel, ktr_dev->program};
-        midipacket_add_(ktr_dev, timestamp, sizeof(pchange), pchange);
+        midi_event_add_(ktr_dev, ump_program_change(ktr_dev->channel, ktr_dev->program));
 
         /* exit block */
         break;
@@ -360,11 +383,9 @@ static void handle_input_report(void * inContext,
 #else
     if (report_idx_changed_(ktr_dev, BTN_HANDLE_IDX)) {
         if (!ktr_dev->in_report[BTN_HANDLE_IDX]) {
-            uint8_t pitch_bender[3]= {0xE0 | ktr_dev->channel, 0, 0x40};
-            midipacket_add_(ktr_dev, timestamp, sizeof(pitch_bender), pitch_bender);
+            midi_event_add_(ktr_dev, ump_pitch_bend(ktr_dev->channel, 0, 0x40));
         } else {
-            uint8_t mod_wheel[3]= {0xB0 | ktr_dev->channel, 1, 0x00};
-            midipacket_add_(ktr_dev, timestamp, sizeof(mod_wheel), mod_wheel);
+            midi_event_add_(ktr_dev, ump_control_change(ktr_dev->channel, 1, 0x00));
         }
     }
 #endif
@@ -374,12 +395,12 @@ static void handle_input_report(void * inContext,
         uint8_t val = ktr_dev->in_report[MISC_TOUCHSTRIP_IDX];
         if (ktr_dev->in_report[BTN_HANDLE_IDX]) {
             /* in MIDI mode pitch bender is 0x40 (center) when not touching the strip */
-            uint8_t pitch_bender[3]= {0xE0 | ktr_dev->channel, 0, val ? val : 0x40};
-            midipacket_add_(ktr_dev, timestamp, sizeof(pitch_bender), pitch_bender);
+            /* scale to 14 bits so 0x7F reaches full bend on both MIDI 1.0 and MIDI 2.0 outputs */
+            uint16_t bend = ump_scale_up(val ? val : 0x40, 7, 14);
+            midi_event_add_(ktr_dev, ump_pitch_bend(ktr_dev->channel, bend & 0x7F, bend >> 7));
         } else if (val) {
             /* in MIDI mode modulation wheel is not reset to zero when not touching the strip */
-            uint8_t mod_wheel[3]= {0xB0 | ktr_dev->channel, 1, val};
-            midipacket_add_(ktr_dev, timestamp, sizeof(mod_wheel), mod_wheel);
+            midi_event_add_(ktr_dev, ump_control_change(ktr_dev->channel, 1, val));
         }
     }
 
@@ -400,18 +421,16 @@ static void handle_input_report(void * inContext,
     /* handle pedal and switch */
     uint8_t pedal_changed_bits = report_idx_changed_bits_(ktr_dev, MISC_PEDAL_IDX);
     if (pedal_changed_bits & 0x80) {
-        uint8_t sustain_pedal[3]= {0xB0 | ktr_dev->channel, 0x40,
-            (ktr_dev->in_report[MISC_PEDAL_IDX] & 0x80) ? 0x7F : 0x00};
-        midipacket_add_(ktr_dev, timestamp, sizeof(sustain_pedal), sustain_pedal);
+        midi_event_add_(ktr_dev, ump_control_change(ktr_dev->channel, 0x40,
+            (ktr_dev->in_report[MISC_PEDAL_IDX] & 0x80) ? 0x7F : 0x00));
     }
     if (pedal_changed_bits & 0x7F) {
-        uint8_t pedal[3]= {0xB0 | ktr_dev->channel, ktr_dev->pedal_midi_ctrl,
-            ktr_dev->in_report[MISC_PEDAL_IDX]};
-        midipacket_add_(ktr_dev, timestamp, sizeof(pedal), pedal);
+        midi_event_add_(ktr_dev, ump_control_change(ktr_dev->channel, ktr_dev->pedal_midi_ctrl,
+            ktr_dev->in_report[MISC_PEDAL_IDX] & 0x7F));
     }
 
 send_midi_cmds:
-    midipacketlist_send_(ktr_dev);
+    midi_events_send_(ktr_dev, timestamp);
     memcpy(ktr_dev->last_in_report, ktr_dev->in_report, ktr_dev->in_report_size);
 }
 
@@ -470,11 +489,6 @@ static void add_matching_device(void *inContext, IOReturn inResult,
     if (!newdev)
         goto fail;
 
-    newdev->midi_packetlist_sz = MIDI_BUFSZ;
-    newdev->midi_packetlist = calloc(1, newdev->midi_packetlist_sz);
-    if (!newdev->midi_packetlist)
-        goto fail;
-
     newdev->in_report_size = max_report_size;
     newdev->octave = DEFAULT_OCTAVE;
     newdev->program = MIN_PROGRAM;
@@ -488,9 +502,29 @@ static void add_matching_device(void *inContext, IOReturn inResult,
     status = MIDIClientCreate(client_name, NULL, NULL, &newdev->midiclient);
     if (status)
         goto fail;
-    status = MIDISourceCreate (newdev->midiclient, source_name, &newdev->midiout);
-    if (status)
-        goto fail;
+#if USE_MIDI2_UMP_OUTPUT
+    if (__builtin_available(macOS 11.0, *)) {
+        status = MIDISourceCreateWithProtocol(newdev->midiclient, source_name, kMIDIProtocol_2_0,
+                                              &newdev->midiout);
+        if (!status) {
+            newdev->midi_eventlist_sz = MIDI_EVENTLIST_SZ;
+            newdev->midi_eventlist = calloc(1, newdev->midi_eventlist_sz);
+            if (!newdev->midi_eventlist)
+                goto fail;
+            newdev->midi2_output = true;
+        }
+    }
+#endif
+    /* fall back to a MIDI 1.0 source */
+    if (!newdev->midi2_output) {
+        status = MIDISourceCreate (newdev->midiclient, source_name, &newdev->midiout);
+        if (status)
+            goto fail;
+        newdev->midi_packetlist_sz = MIDI_BUFSZ;
+        newdev->midi_packetlist = calloc(1, newdev->midi_packetlist_sz);
+        if (!newdev->midi_packetlist)
+            goto fail;
+    }
     status = MIDIOutputPortCreate(newdev->midiclient, port_name, &newdev->midiport);
     if (status)
         goto fail;
@@ -521,6 +555,10 @@ fail:
             free(newdev->in_report);
         if (newdev->midi_packetlist)
             free(newdev->midi_packetlist);
+#if USE_MIDI2_UMP_OUTPUT
+        if (newdev->midi_eventlist)
+            free(newdev->midi_eventlist);
+#endif
         if (newdev->midiclient)
             MIDIClientDispose(newdev->midiclient);
         free(newdev);
@@ -566,6 +604,10 @@ static void rm_matching_device(void *inContext, IOReturn inResult,
         free(olddev->in_report);
     if (olddev->midi_packetlist)
         free(olddev->midi_packetlist);
+#if USE_MIDI2_UMP_OUTPUT
+    if (olddev->midi_eventlist)
+        free(olddev->midi_eventlist);
+#endif
     free(olddev);
 
     printf("MIDI Client disposed\n");